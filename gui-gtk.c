@@ -33,6 +33,8 @@ struct displayarea
     float scale;
 };
 
+const int gui_headless = 0;
+
 static struct displayarea areas[4];
 
 static GtkListStore *slotsModel;
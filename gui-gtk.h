@@ -32,6 +32,9 @@ void gui_unregister(struct displayslot *);
 void gui_bind(struct displayslot *);
 void gui_unbind(struct displayslot *);
 
+/* 1 when linked with gui-null.c, where uploaded images are never drawn */
+extern const int gui_headless;
+
 /* do not use this, see gui_upload from gui.h */
 cairo_surface_t *gui_do_upload(int width, int height, const void *bytes, int gray);
 
@@ -0,0 +1,27 @@
+#include <cairo.h>
+
+#include "gui-gtk.h"
+
+/* ------------------------------------------------------------------------- */
+
+/* the gui of gui-gtk.c, minus the gui. linked instead of it into programs
+ * that run where there is no display, like ewo-index. images are still
+ * uploaded, to plain image surfaces, but nothing ever draws them. */
+
+const int gui_headless = 1;
+
+void gui_register(struct displayslot *ds) { }
+void gui_unregister(struct displayslot *ds) { }
+void gui_bind(struct displayslot *ds) { }
+void gui_unbind(struct displayslot *ds) { }
+
+void gui_status(const char *fmt, ...) { }
+void gui_progress(float value) { }
+void gui_init(int *argc, char ***argv) { }
+
+/* from image.c */
+cairo_surface_t *img_make_surface(int width, int height, const void *bytes, int gray);
+cairo_surface_t *gui_do_upload(int width, int height, const void *bytes, int gray)
+{
+    return img_make_surface(width, height, bytes, gray);
+}
@@ -1,21 +1,27 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <cairo.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
 static void *img_expand24(int width, int height, int stride, const void *bytes)
 {
-    uint8_t *rgb = malloc(width*height*3);
+    uint8_t *rgb = malloc((size_t)width*height*3);
     if(rgb == NULL) return NULL;
 
     int adjust = stride - 3*width;
     const uint8_t *p = bytes;
     uint8_t *q = rgb;
 
-    while(p < (const uint8_t *)bytes + width*height) {
+    while(p < (const uint8_t *)bytes + (size_t)width*height) {
         const uint8_t *end = p + width;
         while(p < end) {
             *q++ = *p;
@@ -31,14 +37,14 @@ static void *img_expand24(int width, int height, int stride, const void *bytes)
 
 static void *img_expand32(int width, int height, int stride, const void *bytes)
 {
-    uint32_t *rgb = malloc(width*height*4);
+    uint32_t *rgb = malloc((size_t)width*height*4);
     if(rgb == NULL) return NULL;
 
     int adjust = stride - 4*width;
     const uint8_t *p = bytes;
     uint32_t *q = rgb;
 
-    while(p < (const uint8_t *)bytes + width*height) {
+    while(p < (const uint8_t *)bytes + (size_t)width*height) {
         const uint8_t *end = p + width;
         while(p < end)
             *q++ = 0x010101 * (*p++);
@@ -50,14 +56,14 @@ static void *img_expand32(int width, int height, int stride, const void *bytes)
 
 static void *img_collapse24(int width, int height, int stride, const void *rgb)
 {
-    uint8_t *bytes = malloc(width*height);
+    uint8_t *bytes = malloc((size_t)width*height);
     if(bytes == NULL) return NULL;
 
     int adjust = stride - 3*width;
     uint8_t *p = bytes;
     const uint8_t *q = rgb;
 
-    while(p < bytes + width*height) {
+    while(p < bytes + (size_t)width*height) {
         const uint8_t *end = p + width;
         while(p < end) {
             *p++ = *q;
@@ -72,7 +78,149 @@ static void *img_collapse24(int width, int height, int stride, const void *rgb)
 
 
 
-int img_read(const char *filename, int *widthp, int *heightp, uint8_t **bytesp)
+/* netpbm files (pgm and ppm, binary and plain) are parsed here instead of
+ * going through gdk-pixbuf, which would expand them to rgb just for us to
+ * throw two channels away again. */
+
+static const char *pnm_skip(const char *p, const char *end)
+{
+    while(p < end) {
+        if(*p == '#')
+            while(p < end && *p != '\n') p++;
+        else if(isspace((unsigned char)*p))
+            p++;
+        else
+            break;
+    }
+    return p;
+}
+
+static const char *pnm_number(const char *p, const char *end, int *value)
+{
+    p = pnm_skip(p, end);
+    if(p == end || !isdigit((unsigned char)*p))
+        return NULL;
+
+    long v = 0;
+    while(p < end && isdigit((unsigned char)*p)) {
+        v = v*10 + (*p++ - '0');
+        if(v > INT_MAX) return NULL;
+    }
+    *value = v;
+    return p;
+}
+
+/* smaller pgm's are copied, rather than mapped for as long as they are
+ * used, which would turn rewriting the file in place into a SIGBUS */
+#define PNM_MAP_MIN (1 << 20)
+
+/* returns 1 if the file is not something we handle, so the caller can try
+ * gdk-pixbuf instead. with mapp set an 8-bit binary pgm of PNM_MAP_MIN
+ * bytes or more is not copied: the pixels are returned in place and *mapp
+ * is the mapping to unmap. */
+static int pnm_load(const char *filename, int *widthp, int *heightp, uint8_t **bytesp,
+                    void **mapp, size_t *map_sizep)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if(st.st_size < 3) {
+        close(fd);
+        return 1;
+    }
+
+    /* private and writable, the pixels are ours to scribble on */
+    size_t size = st.st_size;
+    char *file = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file == MAP_FAILED)
+        return -1;
+
+    char type = file[1];
+    if(file[0] != 'P' || (type != '2' && type != '3' && type != '5' && type != '6')) {
+        munmap(file, size);
+        return 1;
+    }
+
+    const char *p = file + 2, *end = file + size;
+    int width, height, maxval;
+    if(!(p = pnm_number(p, end, &width)) ||
+       !(p = pnm_number(p, end, &height)) ||
+       !(p = pnm_number(p, end, &maxval)) ||
+       width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535 ||
+       p == end || !isspace((unsigned char)*p)) {
+        munmap(file, size);
+        return -1;
+    }
+    p++;
+
+    int channels = type == '3' || type == '6' ? 3 : 1,
+        binary   = type == '5' || type == '6',
+        sample   = maxval < 256 ? 1 : 2;
+    size_t pixels = (size_t)width*height;
+
+    if(binary && (size_t)(end - p) < pixels*channels*sample) {
+        munmap(file, size);
+        return -1;
+    }
+
+    if(mapp && type == '5' && maxval == 255 && size >= PNM_MAP_MIN) {
+        *widthp = width;
+        *heightp = height;
+        *bytesp = (uint8_t *)p;
+        *mapp = file;
+        *map_sizep = size;
+        return 0;
+    }
+
+    uint8_t *bytes = malloc(pixels);
+    if(bytes == NULL) {
+        munmap(file, size);
+        return -1;
+    }
+
+    /* colour images keep the red channel, like the pixbuf path */
+    const uint8_t *q = (const uint8_t *)p;
+    size_t i;
+    for(i = 0; i < pixels; i++) {
+        int v = 0;
+        if(binary) {
+            v = sample == 1 ? q[0] : q[0] << 8 | q[1];
+            if(v > maxval) v = maxval;
+            q += channels*sample;
+        } else {
+            int c;
+            for(c = 0; c < channels; c++) {
+                int w;
+                if(!(p = pnm_number(p, end, &w)) || w > maxval) {
+                    free(bytes);
+                    munmap(file, size);
+                    return -1;
+                }
+                if(c == 0) v = w;
+            }
+        }
+        bytes[i] = maxval == 255 ? v : ((unsigned)v*255 + maxval/2) / maxval;
+    }
+
+    munmap(file, size);
+    *widthp = width;
+    *heightp = height;
+    *bytesp = bytes;
+    if(mapp) {
+        *mapp = NULL;
+        *map_sizep = 0;
+    }
+    return 0;
+}
+
+static int img_read_pixbuf(const char *filename, int *widthp, int *heightp, uint8_t **bytesp)
 {
     GdkPixbuf *pb =
         gdk_pixbuf_new_from_file(filename, NULL);
@@ -104,6 +252,27 @@ int img_read(const char *filename, int *widthp, int *heightp, uint8_t **bytesp)
     return 0;
 }
 
+int img_read(const char *filename, int *widthp, int *heightp, uint8_t **bytesp)
+{
+    int ret = pnm_load(filename, widthp, heightp, bytesp, NULL, NULL);
+    if(ret != 1)
+        return ret;
+    return img_read_pixbuf(filename, widthp, heightp, bytesp);
+}
+
+/* like img_read, but the bytes may live in a private file mapping; if *mapp
+ * is set on return, release them with munmap(*mapp, *map_sizep) instead of free */
+int img_map(const char *filename, int *widthp, int *heightp, uint8_t **bytesp,
+            void **mapp, size_t *map_sizep)
+{
+    int ret = pnm_load(filename, widthp, heightp, bytesp, mapp, map_sizep);
+    if(ret != 1)
+        return ret;
+    *mapp = NULL;
+    *map_sizep = 0;
+    return img_read_pixbuf(filename, widthp, heightp, bytesp);
+}
+
 int img_write(const char *filename, int width, int height, const uint8_t *bytes)
 {
     int fnamelen = strlen(filename);
@@ -141,16 +310,15 @@ int img_write(const char *filename, int width, int height, const uint8_t *bytes)
     return 0;
 }
 
-static inline int mini(int a, int b) { return a < b ? a : b; }
 uint32_t img_checksum(int width, int height, const uint8_t *bytes)
 {
     uint32_t sum1 = 0xffff, sum2 = 0xffff;
 
-    int len = width*height/2;
+    size_t len = (size_t)width*height/2;
     const uint16_t *ptr = (const uint16_t *)bytes;
 
     while (len) {
-        int block = mini(360, len);
+        int block = len < 360 ? len : 360;
         len -= block;
         while(block--) 
             sum1 += *ptr++,
@@ -159,8 +327,8 @@ uint32_t img_checksum(int width, int height, const uint8_t *bytes)
         sum2 = (sum2 & 0xffff) + (sum2 >> 16);
     }
     
-    if(width*height%2 == 1)
-        sum1 += bytes[width*height-1], sum2 += sum1;
+    if((size_t)width*height%2 == 1)
+        sum1 += bytes[(size_t)width*height-1], sum2 += sum1;
     
     sum1 = (sum1 & 0xffff) + (sum1 >> 16);
     sum2 = (sum2 & 0xffff) + (sum2 >> 16);
@@ -194,7 +362,7 @@ cairo_surface_t *img_make_surface(int width, int height, const void *bytes, int
         format = CAIRO_FORMAT_ARGB32;
         stride = cairo_format_stride_for_width(format, width);
         assert(stride == sizeof(uint32_t)*width);
-        data = memdup(bytes, width*height*sizeof(uint32_t));
+        data = memdup(bytes, (size_t)width*height*sizeof(uint32_t));
     }
 
     if(data == NULL)
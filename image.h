@@ -15,6 +15,8 @@
 /* stuff in image.c */
 extern "C" {
     int img_read(const char *filename, int *widthp, int *heightp, uint8_t **bytesp);
+    int img_map(const char *filename, int *widthp, int *heightp, uint8_t **bytesp,
+                void **mapp, size_t *map_sizep);
     int img_write(const char *filename, int width, int height, const uint8_t *bytes);
     uint32_t img_checksum(int width, int height, const uint8_t *bytes);
 };
@@ -64,7 +66,9 @@ public:
 
 /* our images
  * you can load and save to pgm's, png's and jpeg's.
- * however bear in mind that when loading colour images, only the red channel is used! */
+ * however bear in mind that when loading colour images, only the red channel is used!
+ * big 8-bit binary pgm's are not even read, their pixels are mapped in place,
+ * so such files must be replaced, not rewritten in place, while in use. */
 class Image : public Array2D<uint8_t>
 {
 public:
@@ -75,7 +79,7 @@ public:
     inline static Image read(const char *filename)
     {
         Image ret;
-        if(img_read(filename, &ret.width,&ret.height,&ret.data) == -1)
+        if(img_map(filename, &ret.width,&ret.height,&ret.data, &ret.mapping,&ret.mappingSize) == -1)
             throw std::runtime_error("failed to read image");
         return ret;
     }
@@ -87,7 +91,7 @@ public:
     }
 
     inline void fill(uint8_t with) {
-        memset(data, with, width*height);
+        memset(data, with, (size_t)width*height);
     }
 
     inline uint32_t checksum() const {
@@ -1,6 +1,7 @@
 #ifndef __POI_H__
 #define __POI_H__
 
+#include <cstdio>
 #include <cmath>
 #include <cassert>
 #include <vector>
@@ -32,14 +33,74 @@ inline bool POIlessX(const POI &p1, const POI &p2) {
 
 typedef std::vector<POI> POIvec;
 
-Array2D<float> evaluateImage(const Image &src, const std::vector<float> &scales, int steps);
+/* with 'pyramid' set, coarse scales are evaluated on downsampled images
+ * and interpolated back, which is much faster but only approximate */
+Array2D<float> evaluateImage(const Image &src, const std::vector<float> &scales, int steps, bool pyramid = false);
 Image visualizeEvaluation(const Array2D<float> &eval);
-POIvec extractPOIs(const Array2D<float> &eval, float threshold);
+/* with 'limit' > 0, only the best 'limit' local maxima are returned */
+POIvec extractPOIs(const Array2D<float> &eval, float threshold, int limit = 0);
+/* evaluateImage and extractPOIs in one go. with 'window' > 0, the image
+ * is processed in overlapping windows of about window x window pixels,
+ * so that memory use does not depend on the image size */
+POIvec detectPOIs(const Image &src, const std::vector<float> &scales, int steps,
+                  float threshold, bool pyramid = false, int window = 0, int limit = 0);
+/* rotation-normalized POI descriptors: for every scale, the evaluation
+ * profile over directions, starting at the dominant direction and
+ * quantized to bytes. row i describes pois[i]. */
+Array2D<uint8_t> describePOIs(const Image &src, const POIvec &pois,
+                              const std::vector<float> &scales, int steps);
+/* nearest neighbours in b of descriptors of a, as (a index, b index) pairs.
+ * matches not clearly better than the second best are dropped, the rest
+ * come in increasing order of best to second best distance ratio. */
+std::vector<std::pair<int,int> > matchDescriptors(const Array2D<uint8_t> &a, const Array2D<uint8_t> &b,
+                                                  float ratio = .8f);
 POIvec filterPOIs(const POIvec &all, int count, float tabuScale, const Matrix &M);
+
+/* filterPOIs with a matrix, for repeated use. selected POIs are kept in a
+ * grid instead of a painted tabu image, and all buffers are kept between
+ * calls, so that a filter per thread does not allocate in the long run */
+class TabuFilter
+{
+    std::vector<int> head, next; /* grid of linked lists of selected POIs */
+    std::vector<int> sx, sy, rr; /* their rounded coordinates and squared radii */
+
+public:
+    /* 'indices', if given, receives indices of the selected POIs in 'all' */
+    void filter(const POIvec &all, int count, float tabuScale, const Matrix &M, POIvec &selected,
+                std::vector<int> *indices = NULL);
+};
+
 POIvec filterPOIs(const POIvec &all, int count, float *foundTabu = NULL);
 
 /* ----------------------------------------------------------------------- */
 
+/* uniform grid over a set of points, for nearest point queries that
+ * have to skip some of the points */
+class PointGrid
+{
+    std::vector<Point> points;
+    float minx, miny, cell;
+    int gw, gh;
+    std::vector<int> cellStart, ids; /* ids of cell i are ids[cellStart[i]..cellStart[i+1]-1] */
+
+public:
+    inline PointGrid() : gw(0), gh(0) { }
+
+    void build(const POIvec &pois);
+
+    /* index of the point nearest to p, skipping point 'skip' and, if
+     * 'counts' are given, every point i with counts[i] >= limit.
+     * -1 if there is no such point. ties go to the lowest index,
+     * just like in a linear scan. */
+    int nearest(Point p, const char *counts = NULL, int limit = 0, int skip = -1) const;
+};
+
+/* euclidean distance from every pixel to the nearest of 'pois', which
+ * are rounded to pixels first */
+Array2D<float> distanceTransform(const POIvec &pois, int width, int height);
+
+/* ----------------------------------------------------------------------- */
+
 /* 
  * the ProximityMap universe accelerator
  *
@@ -55,12 +116,17 @@ POIvec filterPOIs(const POIvec &all, int count, float *foundTabu = NULL);
  * accounting for those considerations, the overall structure size is
  *   ( width * detail ) * ( height * detail ) * entries
  *
- * the structure is filled-in by using something similar to dijkstra's
- * algorithm. it is hoped, that it is correct (looks good). however,
- * filling speed is not very good. because of this, values of
- * 'entries' and (most importantly) 'detail' cannot be very large.
- * actually any 'detail' > 2 is of no practical value. value of
- * 'entries' can be kept around 10. 
+ * the structure is filled-in exactly, in parallel bands of rows. the
+ * subpixels are grouped in blocks, and for each block only the pois
+ * that can possibly be among nearest ones of any of its subpixels
+ * are considered (see blockCandidates). equally distant pois are
+ * ordered by id. verify() checks the map against brute force.
+ *
+ * the structure can get very large, so it can be compressed instead:
+ * with 'cell' > 0, every cell x cell block of subpixels keeps only the
+ * list of pois that can be among nearest ones of any of its subpixels.
+ * lookups then rank the list by distance, which gives the same pois as
+ * the full map would, but needs a buffer to put them into.
  *
  * to support the pixel subdivision, there are two coordinate systems.
  * one, used internally, asks for an array of size widet x hedet, 
@@ -78,67 +144,125 @@ public:
 private:
     int width, height, detail, entries;
     poiid_t *data;
-   
-    /* those are used only during map's building.
-     * the array is freed after use */ 
-    Array2D<poiid_t> usedEntries;
+    bool attached; /* data is someone else's memory */
     int widet, hedet;
 
-    /* the thing that you put on heap in dijkstra's algoritm */
-    struct djk {
-        float dist; /* distance of coordinates from poi */
-        int xi, yi; /* the coordinates */
-        poiid_t id; /* which poi's area is this */
-
-        inline djk() { }
-        inline djk(float dist, int xi, int yi, poiid_t id)
-            : dist(dist), xi(xi), yi(yi), id(id) { }
-
-        inline bool operator<(const djk &o) const {
-            return dist != o.dist ? dist > o.dist :
-                   id   != o.id   ? id   > o.id :
-                   xi   != o.xi   ? xi   > o.xi :
-                                    yi   > o.yi;
-        }
-    };
-    
-    /* helpers to build() */
-    void pushEntry(const djk &o);
-    bool canVisit(const djk &o) const;
-    
+    /* full maps are stored in tiles of TILE x TILE subpixels, so that
+     * lookups near each other hit the same cache lines and pages */
+    enum { TILE = 8 };
+    int tilesX, tilesY;
+    inline size_t offset(int xi, int yi) const {
+        return ((size_t)(yi / TILE * tilesX + xi / TILE) * (TILE*TILE) +
+                yi % TILE * TILE + xi % TILE) * entries;
+    }
+
+    /* the compressed map. list of cell i is
+     * cellPois[cellStart[i]] .. cellPois[cellStart[i+1]-1] */
+    int cell, cellsX, cellsY;
+    std::vector<uint32_t> cellStart;
+    std::vector<poiid_t> cellPois;
+
+    /* all POIs the map was given, for the ranking and for the updates.
+     * removed POIs keep their place, so that ids don't change */
+    std::vector<Point> points;
+    std::vector<bool> active;
+    int nactive;
+
+    class BuildJob;
+
+    /* the point a subpixel stands for. it is multiplied, so that the
+     * builder and the lookups round it the same way */
+    float invDetail;
+    inline Point subpixel(int xi, int yi) const {
+        return Point(xi * invDetail, yi * invDetail);
+    }
+
+    void rank(int xi, int yi, poiid_t *out) const;
+    void allocate();
+
+    /* the updates. add() repairs the map after points[id] became active,
+     * drop() after it stopped being so */
+    std::vector<int> activeIds() const;
+    void rerank(int xi, int yi, const std::vector<int> &cand);
+    void add(int id);
+    void drop(int id);
+    void replaceLists(const std::vector<std::pair<size_t, std::vector<int> > > &changes);
+
 public:
     ProximityMap();
     ~ProximityMap();
 
-    void resize(int width, int height, int detail, int entries);
+    void resize(int width, int height, int detail, int entries, int cell = 0);
     void build(const POIvec &pois);
+    /* number of subpixels whose entries are not the nearest active pois */
+    int verify() const;
+
+    /* changes to a built map, which repair only the subpixels (or cells)
+     * whose nearest POIs change. other POIs keep their ids. */
+    bool remove(int id); /* false if it is not there, or too few POIs would be left */
+    bool restore(int id); /* brings a removed POI back */
+    int insert(Point p); /* id of the new POI */
+    inline bool isActive(int id) const { return active[id]; }
 
     inline int getWidth() const { return width; }
     inline int getHeight() const { return height; }
     inline int getDetail() const { return detail; }
     inline int getEntries() const { return entries; }
+    inline int getCell() const { return cell; }
+
+    /* bytes held, not counting attached memory */
+    size_t footprint() const;
 
     ColorImage visualize() const;
 
-    /* this is internal array access interface.
-     * _at(xi,yi) is an array if 'entries' poi ids.
-     * this is exposed as public *only* for the caching module. */
+    /* binary image of the map, for the caching module. the subpixels
+     * start at a multiple of FILE_ALIGN bytes into the file. */
+    enum { FILE_ALIGN = 4096 };
+    bool read(FILE *f);
+    bool write(FILE *f) const;
+    /* read() from a file mapped at 'file', 'size' bytes long, starting
+     * 'pos' bytes in. full maps use the mapped subpixels as they are,
+     * which have to stay mapped, and writable if the map is changed. */
+    bool attach(char *file, size_t size, size_t pos);
+
+    /* this is internal array access interface of full maps.
+     * _at(xi,yi) is an array if 'entries' poi ids. */
     inline poiid_t *_at(int xi, int yi) {
         //assert(0 <= xi && xi < widet && 0 <= yi && yi <= hedet);
-        return data + widet*entries*yi + entries*xi;
+        return data + offset(xi,yi);
     }
     inline const poiid_t *_at(int xi, int yi) const {
         //assert(0 <= xi && xi < widet && 0 <= yi && yi <= hedet);
-        return data + widet*entries*yi + entries*xi;
+        return data + offset(xi,yi);
     }
 
     /* this is the official access interface.
-     * at(x,y) is an array if 'entries' poi ids. */
-    inline poiid_t *at(float x, float y) {
-        return _at(roundf(x * detail), roundf(y * detail));
+     * at(x,y) is an array if 'entries' poi ids. compressed maps put
+     * them into 'buf', which has to have room for 'entries' ids. */
+    inline const poiid_t *at(float x, float y, poiid_t *buf) const {
+        int xi = roundf(x * detail), yi = roundf(y * detail);
+        if(!cell)
+            return _at(xi,yi);
+        rank(xi,yi, buf);
+        return buf;
     }
+
+    /* at(x,y) of full maps whose detail and entries are known when
+     * compiling, so that no multiplications by them are left */
+    template<int DETAIL, int ENTRIES>
     inline const poiid_t *at(float x, float y) const {
-        return _at(roundf(x * detail), roundf(y * detail));
+        int xi = roundf(x * DETAIL), yi = roundf(y * DETAIL);
+        return data + ((size_t)(yi / TILE * tilesX + xi / TILE) * (TILE*TILE) +
+                       yi % TILE * TILE + xi % TILE) * ENTRIES;
+    }
+
+    /* starts fetching what at(x,y) will need */
+    inline void prefetch(float x, float y) const {
+        int xi = roundf(x * detail), yi = roundf(y * detail);
+        if(!cell)
+            __builtin_prefetch(_at(xi,yi));
+        else
+            __builtin_prefetch(&cellStart[(size_t)(yi / cell) * cellsX + xi / cell]);
     }
 };
 
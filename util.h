@@ -2,11 +2,17 @@
 #define __UTIL_H__
 
 #include <cstdlib>
+#include <cstdio>
 #include <cmath>
 #include <ctime>
 #include <cstring>
+#include <algorithm>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
 #define info(fmt, ...)  printf("   " fmt "\n", ## __VA_ARGS__)
 #define okay(fmt, ...)  printf(" + " fmt "\n", ## __VA_ARGS__)
@@ -25,29 +31,45 @@ template <typename T> class Array2D
 protected:
     int width, height;
     T *data;
-
-    inline void _init() { width = height = 0; data = NULL; }
+    /* when set, data points into this private file mapping */
+    void *mapping;
+    size_t mappingSize;
+
+    inline void _init() { width = height = 0; data = NULL; mapping = NULL; mappingSize = 0; }
+    inline void _unmap() {
+        munmap(mapping, mappingSize);
+        data = NULL; mapping = NULL; mappingSize = 0;
+    }
 public:
     inline Array2D() { _init(); }
     inline Array2D(int w, int h) { _init(); resize(w,h); }
     inline Array2D(const Array2D<T> &im) { _init(); (*this) = im; }
-    inline ~Array2D() { free(data); }
+    inline ~Array2D() { if(mapping) _unmap(); else free(data); }
     
-    inline T* operator[](int row) const { return data + row*width; }
+    inline T* operator[](int row) const { return data + (size_t)row*width; }
 
     inline void resize(int w, int h)
     {
         if(width == w && height == h)
             return;
         width = w; height = h;
-        data = (T *)realloc(data, width*height*sizeof(T));
+        if(mapping) _unmap();
+        data = (T *)realloc(data, (size_t)width*height*sizeof(T));
         if(width && height && !data) throw std::bad_alloc();
     }
 
+    /* copies are made by assignment, this is how to hand data over */
+    inline void swap(Array2D<T> &a)
+    {
+        std::swap(width, a.width); std::swap(height, a.height);
+        std::swap(data, a.data);
+        std::swap(mapping, a.mapping); std::swap(mappingSize, a.mappingSize);
+    }
+
     inline Array2D<T>& operator=(const Array2D<T>& im)
     {
         resize(im.width, im.height);
-        memcpy(data, im.data, width*height*sizeof(T));
+        memcpy(data, im.data, (size_t)width*height*sizeof(T));
         return *this;
     }
     
@@ -56,7 +78,7 @@ public:
     inline bool inside(int x, int y) const { return x>=0 && y>=0 && x<width && y<height; }
 
     inline void fill(const T &v) {
-        for(int i=0; i<width*height; i++)
+        for(size_t i=0; i<(size_t)width*height; i++)
             data[i] = v;
     }
 };
@@ -294,7 +316,8 @@ class AsyncQueue
     pthread_mutex_t mutex;
     pthread_cond_t cond;
 
-    AsyncJob *first, **last;
+    /* jobs waited for now, then those of background threads */
+    AsyncJob *first[2], **last[2];
 
 public:
     AsyncQueue();
@@ -302,6 +325,11 @@ public:
 
     void queue(AsyncJob *job);
     AsyncJob *get(void);
+
+    /* jobs queued by the calling thread from now on run only when no
+     * others wait, so that building ahead doesn't hold up what is
+     * waited for right now */
+    static void background();
 };
 
 class WorkerThread
@@ -316,7 +344,186 @@ public:
 };
 
 extern AsyncQueue *aq;
+extern int worker_threads; /* how many threads serve aq */
 void spawn_worker_threads(int n);
 
+/* builds the items for a list of paths in a thread of its own, in order,
+ * so that they are ready by the time they are asked for. it stays at most
+ * 'depth' items and 'limit' bytes (0 for no limit) ahead of the consumer,
+ * though one item is always built. T needs a static T *load(const char *)
+ * and a size_t footprint() const. the thread may queue jobs on aq, they
+ * go after everybody else's.
+ * items the caller has already, non-NULL in 'given', which has one for
+ * each path, are not loaded but passed to 'refresh', if any, and stay the
+ * caller's. */
+template <class T> class Prefetcher
+{
+    std::vector<std::string> paths;
+    int depth;
+    size_t limit;
+    std::vector<T *> given;
+    void (*refresh)(T *item, const char *path);
+
+    std::vector<T *> items;
+    std::vector<size_t> sizes;
+    std::vector<std::string> errors;
+    int built, taken;
+    size_t bytes; /* of the items built but not taken */
+    bool stop;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    static void *run(void *arg) {
+        AsyncQueue::background();
+        ((Prefetcher<T> *)arg)->produce();
+        return NULL;
+    }
+
+    void produce()
+    {
+        for(int i=0; i<(int)paths.size(); i++) {
+            pthread_mutex_lock(&mutex);
+            while(!stop && built > taken &&
+                  (built - taken >= depth || (limit && bytes >= limit)))
+                pthread_cond_wait(&cond, &mutex);
+            bool quit = stop;
+            pthread_mutex_unlock(&mutex);
+            if(quit)
+                return;
+
+            T *item = NULL;
+            std::string error;
+            try {
+                if(!given[i])
+                    item = T::load(paths[i].c_str());
+                else if(refresh)
+                    refresh(given[i], paths[i].c_str());
+            }
+            catch(std::exception &e) {
+                error = e.what();
+            }
+
+            pthread_mutex_lock(&mutex);
+            if(given[i] && error.empty())
+                item = given[i];
+            items[i] = item;
+            sizes[i] = item && !given[i] ? item->footprint() : 0;
+            errors[i] = error;
+            bytes += sizes[i];
+            built++;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+public:
+    Prefetcher(const std::vector<std::string> &paths, int depth, size_t limit,
+               const std::vector<T *> *given = NULL,
+               void (*refresh)(T *item, const char *path) = NULL)
+        : paths(paths), depth(std::max(depth, 1)), limit(limit),
+          given(given ? *given : std::vector<T *>(paths.size())), refresh(refresh),
+          items(paths.size()), sizes(paths.size()), errors(paths.size()),
+          built(0), taken(0), bytes(0), stop(false)
+    {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+        if(pthread_create(&thread, NULL, run, this))
+            throw std::runtime_error("failed to start prefetching thread");
+    }
+
+    ~Prefetcher()
+    {
+        pthread_mutex_lock(&mutex);
+        stop = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, NULL);
+
+        for(int i=taken; i<built; i++)
+            if(!given[i])
+                delete items[i];
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    /* the next item, which is the caller's now. throws what loading or
+     * refreshing threw */
+    T *next()
+    {
+        pthread_mutex_lock(&mutex);
+        if(taken == (int)paths.size()) {
+            pthread_mutex_unlock(&mutex);
+            throw std::out_of_range("nothing left to prefetch");
+        }
+        while(built <= taken)
+            pthread_cond_wait(&cond, &mutex);
+        int i = taken++;
+        bytes -= sizes[i];
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+
+        if(!items[i])
+            throw std::runtime_error(errors[i]);
+        return items[i];
+    }
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* 64-bit hash of a stream of bytes, good enough to name files by what
+ * they were made of. it doesn't matter how the bytes are split. */
+class Hash64
+{
+    uint64_t h, len;
+    uint8_t buf[8];
+
+    void word(uint64_t w);
+public:
+    inline Hash64(uint64_t seed = 0) : h(seed), len(0) { }
+
+    Hash64 &add(const void *bytes, size_t n);
+    template<typename T> inline Hash64 &add(const T &v) { return add(&v, sizeof(v)); }
+    uint64_t get() const;
+};
+
+/* a directory of cache files, named by hashes of what they were made of,
+ * so that it can be shared by images from anywhere and by processes
+ * running at once. files are written aside and renamed into place, and
+ * the least recently used ones go when the directory gets too big. */
+class CacheDir
+{
+    std::string dir;
+    uint64_t limit;
+
+public:
+    /* 'limit' in bytes, 0 for no limit */
+    CacheDir(const char *dir, uint64_t limit);
+
+    /* path of the cache file for 'filename' made with settings hashed to
+     * 'config', and in 'key', a hash of both the contents and 'config'.
+     * the contents are read only if the file changed since the last time,
+     * its identity, size and time of change are remembered in a link. */
+    std::string lookup(const char *filename, uint64_t config, uint64_t *key);
+
+    /* the key of a file, with no directory, from its contents */
+    static uint64_t contentKey(const char *filename, uint64_t config);
+    /* a hash of where 'filename' is, its size and time of change, and
+     * 'config', cheap enough to tell the file wasn't touched since */
+    static uint64_t identity(const char *filename, uint64_t config);
+
+    /* marks a cache file as just used */
+    void touch(const std::string &path);
+
+    /* a temporary file for 'path'. commit() renames it to 'path' */
+    static FILE *create(const std::string &path, std::string *tmp);
+    static bool commit(const std::string &tmp, const std::string &path);
+
+    /* removes least recently used files over the limit, but not 'keep',
+     * and temporary files left behind by writers that died */
+    void evict(const std::string &keep);
+};
+
 #endif
 